@@ -11,6 +11,7 @@
 #include "stsh-job-list.h"
 #include "stsh-job.h"
 #include "stsh-process.h"
+#include "stsh-parse-utils.h"
 #include <cstring>
 #include <iostream>
 #include <string>
@@ -29,7 +30,12 @@ static void sigchildHandler(int sig);
 static void builtinFg(const pipeline& pipeline);
 static void builtinSignals(const pipeline& pipeline, const string cmdName, int sig);
 static void builtinBg(const pipeline& pipeline);
+static void builtinParallel(const pipeline& pipeline);
+static STSHJob& launchJob(const pipeline& p, STSHJobState state);
 static void transferTerminalControl(pid_t pgid);
+
+static vector<size_t> parallelJobs; // job numbers launched by the active parallel block
+static bool parallelFailed = false; // set by the handlers once some member of the block fails
 /**
  * Function: handleBuiltin
  * -----------------------
@@ -37,7 +43,7 @@ static void transferTerminalControl(pid_t pgid);
  * it's a shell builtin, and if so, handles and executes it.  handleBuiltin
  * returns true if the command is a builtin, and false otherwise.
  */
-static const string kSupportedBuiltins[] = {"quit", "exit", "fg", "bg", "slay", "halt", "cont", "jobs"};
+static const string kSupportedBuiltins[] = {"quit", "exit", "fg", "bg", "slay", "halt", "cont", "jobs", "parallel"};
 static const size_t kNumSupportedBuiltins = sizeof(kSupportedBuiltins)/sizeof(kSupportedBuiltins[0]);
 
 static bool handleBuiltin(const pipeline& pipeline) {
@@ -55,6 +61,7 @@ static bool handleBuiltin(const pipeline& pipeline) {
   case 5: builtinSignals(pipeline, "halt", SIGTSTP); break;
   case 6: builtinSignals(pipeline, "cont", SIGCONT); break;
   case 7: cout << joblist; break;
+  case 8: builtinParallel(pipeline); break;
   default: throw STSHException("Internal Error: Builtin command not supported."); // or not implemented yet
   }
   
@@ -131,6 +138,83 @@ static void builtinSignals(const pipeline& p, const string cmdName, int sig){
   }
 }
 
+/**
+ * Function: builtinParallel
+ * -------------------------
+ * Reads the pipelines that follow "parallel [-j <n>] {", one per line, up
+ * to a line holding just "}", and runs them concurrently as background jobs,
+ * with at most n of them alive at once (all of them if -j isn't given).
+ * Returns only once every job in the block has terminated.  If one of them
+ * fails (its last process exits nonzero or is killed), or the user hits
+ * ctrl-c, no further pipelines are launched, the process groups of the
+ * remaining ones are terminated, and an STSHException is thrown.
+ */
+static void builtinParallel(const pipeline& p){
+  const string usage = "Usage: parallel [-j <n>] {";
+  char * const *tokens = p.commands[0].tokens;
+  size_t numTokens = 0;
+  while(tokens[numTokens] != NULL) numTokens++;
+  if(numTokens == 0 || strcmp(tokens[numTokens - 1], "{") != 0) throw STSHException(usage);
+
+  // consume the whole block before validating anything else, so a bad block isn't left to the repl
+  vector<string> lines;
+  while(true){
+    string line;
+    if(!readline(line)) throw STSHException("parallel: Missing closing }.");
+    if(line == "}") break;
+    if(!line.empty()) lines.push_back(line);
+  }
+
+  size_t limit = 0;
+  if(numTokens == 3 && strcmp(tokens[0], "-j") == 0){
+    limit = parseNumber(tokens[1], usage);
+    if(limit == 0) throw STSHException(usage);
+  } else if(numTokens != 1){
+    throw STSHException(usage);
+  }
+  if(p.commands.size() > 1 || !p.input.empty() || !p.output.empty() || p.background)
+    throw STSHException(usage);
+  for(const string& line : lines){
+    pipeline member(line);
+    const string& command = member.commands[0].command;
+    if(find(kSupportedBuiltins, kSupportedBuiltins + kNumSupportedBuiltins, command) != kSupportedBuiltins + kNumSupportedBuiltins)
+      throw STSHException("parallel: " + command + " is a builtin and can't be run in parallel.");
+  }
+  if(limit == 0) limit = lines.size();
+
+  sigset_t additions, existingmask;
+  sigemptyset(&additions);
+  sigaddset(&additions, SIGINT);
+  sigaddset(&additions, SIGTSTP);
+  sigaddset(&additions, SIGCONT);
+  sigaddset(&additions, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &additions, &existingmask);
+  parallelJobs.clear();
+  parallelFailed = false;
+  bool slain = false;
+  size_t launched = 0;
+  while(true){
+    parallelJobs.erase(remove_if(parallelJobs.begin(), parallelJobs.end(),
+                                 [](size_t num) { return !joblist.containsJob(num); }), parallelJobs.end());
+    if(parallelFailed && !slain){
+      for(size_t num : parallelJobs){
+        pid_t gid = joblist.getJob(num).getGroupID();
+        kill(-gid, SIGTERM);
+        kill(-gid, SIGCONT); // stopped processes only act on SIGTERM once continued
+      }
+      slain = true;
+    }
+    while(!parallelFailed && launched < lines.size() && parallelJobs.size() < limit){
+      pipeline member(lines[launched++]);
+      parallelJobs.push_back(launchJob(member, kBackground).getNum());
+    }
+    if(parallelJobs.empty()) break;
+    sigsuspend(&existingmask);
+  }
+  sigprocmask(SIG_SETMASK, &existingmask, NULL);
+  if(parallelFailed) throw STSHException("parallel: A job failed, so its siblings were terminated.");
+}
+
 /**
  * Function: installSignalHandlers
  * -------------------------------
@@ -162,14 +246,33 @@ static void sigIntStopHandler(int sig){
     vector<STSHProcess>& processes = job.getProcesses();
     for(STSHProcess proc : processes)
       kill(proc.getID(), sig);
+  } else if(sig == SIGINT && !parallelJobs.empty()){
+    parallelFailed = true; // builtinParallel terminates the block once it wakes up
   }
 }
 
+/**
+ * Function: noteParallelFailure
+ * -----------------------------
+ * Records that the active parallel block has failed if the provided pid
+ * is the last process of one of its jobs.  Earlier processes in a pipeline
+ * are ignored, so that (as with any shell) the pipeline's status is that of
+ * its final command.
+ */
+static void noteParallelFailure(pid_t pid){
+  if(!joblist.containsProcess(pid)) return;
+  const STSHJob& job = joblist.getJobWithProcess(pid);
+  if(job.getProcesses().back().getID() != pid) return;
+  if(find(parallelJobs.begin(), parallelJobs.end(), job.getNum()) != parallelJobs.end())
+    parallelFailed = true;
+}
+
 static void sigchildHandler(int sig){
   while(true){
     int status;
     pid_t pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED);
     if(pid <= 0) break;
+    if((WIFEXITED(status) && WEXITSTATUS(status) != 0) || WIFSIGNALED(status)) noteParallelFailure(pid);
     if(WIFEXITED(status) | WIFSIGNALED(status)) changeProcessStatus(pid, kTerminated);
     if(WIFSTOPPED(status)) changeProcessStatus(pid, kStopped);
     if(WIFCONTINUED(status)) changeProcessStatus(pid, kRunning);   
@@ -177,15 +280,15 @@ static void sigchildHandler(int sig){
 }
   
 /**
- * Function: createJob
+ * Function: launchJob
  * -------------------
- * Creates a new job on behalf of the provided pipeline.
+ * Adds a job in the provided state to the job list, forks off one process
+ * per command in the pipeline (wired together with pipes and any requested
+ * redirection, and sharing a process group led by the first), and returns the
+ * new job.  The caller decides whether to wait on it.
  */
-static void createJob(const pipeline& p) {
-//  cout << p; // remove this line once you get started
-//  /* STSHJob& job = */ joblist.addJob(kForeground);
-
-  STSHJob& job = joblist.addJob(p.background ? kBackground : kForeground);
+static STSHJob& launchJob(const pipeline& p, STSHJobState state) {
+  STSHJob& job = joblist.addJob(state);
   pid_t groupid = 0;
   int fds[p.commands.size() - 1][2];
   for(size_t i = 0; i < p.commands.size() - 1; i++) pipe(fds[i]);
@@ -222,6 +325,9 @@ static void createJob(const pipeline& p) {
       for(int t = 0; t < p.commands.size() - 1; t++){
         close(fds[t][0]); close(fds[t][1]);
       }
+      sigset_t none;
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, NULL); // don't pass a blocked mask from the shell on to the command
       setpgid(getpid(), groupid);
       char* argv[kMaxArguments + 2] = {NULL};
       argv[0] = const_cast<char*>(p.commands[i].command);
@@ -229,10 +335,23 @@ static void createJob(const pipeline& p) {
       int err = execvp(argv[0], argv);
       if(err < 0) throw STSHException(std::string(argv[0]) + ": Command not found.");      
     }
+    setpgid(pid, groupid); // also from the parent, so the group exists before anyone signals it
   }
   for(size_t t = 0; t < p.commands.size() - 1; t++){
         close(fds[t][0]); close(fds[t][1]);
   }
+  return job;
+}
+
+/**
+ * Function: createJob
+ * -------------------
+ * Creates a new job on behalf of the provided pipeline.
+ */
+static void createJob(const pipeline& p) {
+  STSHJob& job = launchJob(p, p.background ? kBackground : kForeground);
+  size_t num = job.getNum();
+  pid_t groupid = job.getGroupID();
   if(!p.background){
    sigset_t additions, existingmask;
    sigemptyset(&additions);
@@ -247,7 +366,7 @@ static void createJob(const pipeline& p) {
     transferTerminalControl(groupid);
    }
 
- 	 while(joblist.hasForegroundJob() && joblist.getForegroundJob().getNum() == job.getNum())
+ 	 while(joblist.hasForegroundJob() && joblist.getForegroundJob().getNum() == num)
      sigsuspend(&existingmask);        
   sigprocmask(SIG_UNBLOCK, &additions, &existingmask);
   } 
@@ -291,7 +410,7 @@ int main(int argc, char *argv[]) {
       if (!builtin) createJob(p);
     } catch (const STSHException& e) {
       cerr << e.what() << endl;
-      if (getpid() != stshpid) exit(0); // if exception is thrown from child process, kill it
+      if (getpid() != stshpid) exit(1); // if exception is thrown from child process, kill it (and report failure)
     }
   }
 